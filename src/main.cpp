@@ -1,21 +1,35 @@
 #include <algorithm>
+#include <atomic>
 #include <cctype>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
 #include <cstddef>
+#include <cstdint>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <ctime>
+#include <dirent.h>
 #include <fcntl.h>
 #include <filesystem>
 #include <iostream>
+#include <poll.h>
 #include <readline/history.h>
 #include <readline/readline.h>
 #include <sstream>
 #include <string>
+#include <strings.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <thread>
 #include <unistd.h>
 #include <unordered_set>
 #include <vector>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 static std::string last_prefix;
 static bool last_multiple_matches = false;
 static int tab_press_count = 0;
@@ -27,8 +41,8 @@ char *command_generator(const char *text, int state) {
         match_index = 0;
         std::string textStr(text);
         std::unordered_set<std::string> seen;
-        const std::vector<std::string> vocabulary{"echo", "exit", "type",
-                                                  "pwd",  "cd",   "history"};
+        const std::vector<std::string> vocabulary{
+            "echo", "exit", "type", "pwd", "cd", "history", "set", "tracestat"};
         for (const auto &word : vocabulary) {
             if (word.compare(0, textStr.size(), textStr) == 0 &&
                 word != textStr) {
@@ -73,6 +87,316 @@ char *command_generator(const char *text, int state) {
         return strdup(last_matches[match_index++].c_str());
     }
 }
+std::vector<std::string> split(const std::string &input);
+enum class CompletionContext { Command, Path, Directory };
+// Everything in the current pipeline stage before the word being completed
+// decides what we complete: nothing (or a '|') means a command name, `cd`
+// wants directories, anything else (arguments, redirection targets) a path.
+CompletionContext completion_context(int start) {
+    std::string before(rl_line_buffer, start);
+    size_t stage = before.find_last_of('|');
+    if (stage != std::string::npos)
+        before = before.substr(stage + 1);
+    std::vector<std::string> words = split(before);
+    if (words.empty())
+        return CompletionContext::Command;
+    if (words[0] == "cd" && words.size() == 1)
+        return CompletionContext::Directory;
+    return CompletionContext::Path;
+}
+// Directory entries packed back to back as NUL-terminated names, so the fuzzy
+// matcher can sweep one contiguous buffer with vector compares instead of
+// chasing a pointer per entry. The listing is keyed on the directory's
+// device and inode (the typed path is usually relative) and kept until its
+// mtime changes, so repeated TABs in a huge directory skip the readdir.
+struct DirListing {
+    std::string path;
+    dev_t dev = 0;
+    ino_t ino = 0;
+    struct timespec mtime {};
+    std::string names;
+    std::vector<uint32_t> offsets;
+    std::vector<unsigned char> types;
+};
+static DirListing dir_cache;
+static const size_t kScanPadding = 32;
+// Only the best-ranked names are listed; custom_completion reports how many
+// more matched (path_omitted_matches) so a listing never looks complete
+// when it is not.
+static const size_t kMaxCompletions = 200;
+static size_t path_omitted_matches = 0;
+static const DirListing *load_directory(const std::string &dir) {
+    struct stat st;
+    if (stat(dir.c_str(), &st) != 0 || !S_ISDIR(st.st_mode))
+        return nullptr;
+    if (dir_cache.dev == st.st_dev && dir_cache.ino == st.st_ino &&
+        dir_cache.mtime.tv_sec == st.st_mtim.tv_sec &&
+        dir_cache.mtime.tv_nsec == st.st_mtim.tv_nsec) {
+        // Same directory, possibly reached by another path; entries are
+        // stat'ed relative to the path used now.
+        dir_cache.path = dir;
+        return &dir_cache;
+    }
+    DIR *dp = opendir(dir.c_str());
+    if (!dp)
+        return nullptr;
+    dir_cache.path = dir;
+    dir_cache.dev = st.st_dev;
+    dir_cache.ino = st.st_ino;
+    dir_cache.mtime = st.st_mtim;
+    dir_cache.names.clear();
+    dir_cache.offsets.clear();
+    dir_cache.types.clear();
+    while (struct dirent *entry = readdir(dp)) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+            continue;
+        dir_cache.offsets.push_back(dir_cache.names.size());
+        dir_cache.types.push_back(entry->d_type);
+        dir_cache.names.append(entry->d_name);
+        dir_cache.names.push_back('\0');
+    }
+    closedir(dp);
+    // Zero padding lets the scanners load a full vector past the last name.
+    dir_cache.names.append(kScanPadding, '\0');
+    return &dir_cache;
+}
+// Returns the index of the first byte at or after pos that equals a, b or
+// NUL. Every name ends in a NUL and the buffer carries kScanPadding zero
+// bytes, so the search always terminates inside the buffer.
+static size_t scan_scalar(const char *buf, size_t pos, char a, char b) {
+    while (buf[pos] != a && buf[pos] != b && buf[pos] != '\0')
+        pos++;
+    return pos;
+}
+#if defined(__x86_64__) || defined(__i386__)
+// SSE2 is baseline on x86-64 but not on 32-bit x86, hence the target.
+__attribute__((target("sse2"))) static size_t scan_sse2(const char *buf,
+                                                        size_t pos, char a,
+                                                        char b) {
+    const __m128i va = _mm_set1_epi8(a);
+    const __m128i vb = _mm_set1_epi8(b);
+    const __m128i vz = _mm_setzero_si128();
+    for (;; pos += 16) {
+        __m128i v =
+            _mm_loadu_si128(reinterpret_cast<const __m128i *>(buf + pos));
+        __m128i hit = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(v, va), _mm_cmpeq_epi8(v, vb)),
+            _mm_cmpeq_epi8(v, vz));
+        unsigned mask = _mm_movemask_epi8(hit);
+        if (mask)
+            return pos + __builtin_ctz(mask);
+    }
+}
+__attribute__((target("avx2"))) static size_t scan_avx2(const char *buf,
+                                                        size_t pos, char a,
+                                                        char b) {
+    const __m256i va = _mm256_set1_epi8(a);
+    const __m256i vb = _mm256_set1_epi8(b);
+    const __m256i vz = _mm256_setzero_si256();
+    for (;; pos += 32) {
+        __m256i v =
+            _mm256_loadu_si256(reinterpret_cast<const __m256i *>(buf + pos));
+        __m256i hit = _mm256_or_si256(
+            _mm256_or_si256(_mm256_cmpeq_epi8(v, va), _mm256_cmpeq_epi8(v, vb)),
+            _mm256_cmpeq_epi8(v, vz));
+        unsigned mask = _mm256_movemask_epi8(hit);
+        if (mask)
+            return pos + __builtin_ctz(mask);
+    }
+}
+#endif
+using ScanFn = size_t (*)(const char *, size_t, char, char);
+static ScanFn pick_scan() {
+#if defined(__x86_64__) || defined(__i386__)
+    if (__builtin_cpu_supports("avx2"))
+        return scan_avx2;
+    if (__builtin_cpu_supports("sse2"))
+        return scan_sse2;
+#endif
+    return scan_scalar;
+}
+static const ScanFn scan_for = pick_scan();
+static bool is_word_boundary(const char *name, size_t i) {
+    if (i == 0)
+        return true;
+    char prev = name[i - 1];
+    if (prev == '-' || prev == '_' || prev == '.' || prev == ' ')
+        return true;
+    return std::islower(static_cast<unsigned char>(prev)) &&
+           std::isupper(static_cast<unsigned char>(name[i]));
+}
+// Greedy left-to-right placement of the pattern: consecutive runs, word
+// starts and exact case are rewarded, gaps and leftover length penalised.
+static int fuzzy_score(const char *name, size_t len, const std::string &pat) {
+    int score = 0;
+    size_t prev = std::string::npos;
+    size_t pos = 0;
+    for (char p : pat) {
+        char lower = std::tolower(static_cast<unsigned char>(p));
+        while (std::tolower(static_cast<unsigned char>(name[pos])) != lower)
+            pos++;
+        score += 16;
+        if (name[pos] == p)
+            score += 1;
+        if (is_word_boundary(name, pos))
+            score += 10;
+        if (prev != std::string::npos && pos == prev + 1)
+            score += 8;
+        else if (prev != std::string::npos)
+            score -= std::min<int>(pos - prev - 1, 8);
+        else if (pos == 0)
+            score += 20;
+        else
+            score -= std::min<int>(pos, 8);
+        prev = pos++;
+    }
+    return score - static_cast<int>((len - pat.size()) / 4);
+}
+static bool is_directory_entry(const DirListing &listing, size_t i) {
+    if (listing.types[i] == DT_DIR)
+        return true;
+    if (listing.types[i] != DT_UNKNOWN && listing.types[i] != DT_LNK)
+        return false;
+    struct stat st;
+    std::string full =
+        listing.path + "/" + (listing.names.data() + listing.offsets[i]);
+    return stat(full.c_str(), &st) == 0 && S_ISDIR(st.st_mode);
+}
+// Characters split() or split_pipeline() would otherwise treat as word
+// breaks, quotes or a pipe; readline escapes them with a backslash when it
+// inserts a filename.
+static const char *const kFilenameQuoteChars = " \t\n\\\"'|<>";
+char *quote_filename(char *text, int match_type, char *quote_pointer) {
+    // Inside an open quote the user's quote already protects the name.
+    if (quote_pointer && *quote_pointer)
+        return strdup(text);
+    std::string quoted;
+    for (const char *c = text; *c; ++c) {
+        if (strchr(kFilenameQuoteChars, *c))
+            quoted += '\\';
+        quoted += *c;
+    }
+    return strdup(quoted.c_str());
+}
+// A character preceded by an odd run of backslashes is escaped, so it does not
+// break the completion word.
+int char_is_quoted(char *text, int index) {
+    int backslashes = 0;
+    while (index - backslashes > 0 && text[index - backslashes - 1] == '\\')
+        backslashes++;
+    return backslashes % 2;
+}
+// Candidates whose name starts with the typed text win outright, so plain
+// prefix completion behaves as before; otherwise names containing the text
+// as a subsequence are ranked by fuzzy_score. Both passes use smart case:
+// the text is case-insensitive unless it contains an uppercase letter.
+char **path_completion(const char *text, bool dirs_only) {
+    path_omitted_matches = 0;
+    std::string word;
+    for (const char *c = text; *c; ++c) {
+        if (*c == '\\' && c[1])
+            ++c;
+        word += *c;
+    }
+    size_t slash = word.find_last_of('/');
+    std::string dir_part =
+        (slash == std::string::npos) ? "" : word.substr(0, slash + 1);
+    std::string base = word.substr(dir_part.size());
+    std::string dir = dir_part.empty() ? "." : dir_part;
+    if (dir[0] == '~') {
+        const char *home = std::getenv("HOME");
+        if (home)
+            dir = std::string(home) + dir.substr(1);
+    }
+    const DirListing *listing = load_directory(dir);
+    if (!listing)
+        return nullptr;
+    const char *names = listing->names.data();
+    bool show_hidden = !base.empty() && base[0] == '.';
+    bool smart_case = std::any_of(base.begin(), base.end(), [](char c) {
+        return std::isupper(static_cast<unsigned char>(c));
+    });
+    std::vector<size_t> hits;
+    for (size_t i = 0; i < listing->offsets.size(); ++i) {
+        const char *name = names + listing->offsets[i];
+        if (name[0] == '.' && !show_hidden)
+            continue;
+        int cmp = smart_case ? strncmp(name, base.c_str(), base.size())
+                             : strncasecmp(name, base.c_str(), base.size());
+        if (cmp == 0 &&
+            (!dirs_only || is_directory_entry(*listing, i)))
+            hits.push_back(i);
+    }
+    bool fuzzy = hits.empty();
+    if (fuzzy) {
+        std::vector<char> lower(base.size()), upper(base.size());
+        for (size_t k = 0; k < base.size(); ++k) {
+            unsigned char c = base[k];
+            lower[k] = smart_case ? c : std::tolower(c);
+            upper[k] = smart_case ? c : std::toupper(c);
+        }
+        for (size_t i = 0; i < listing->offsets.size(); ++i) {
+            size_t pos = listing->offsets[i];
+            if (names[pos] == '.' && !show_hidden)
+                continue;
+            size_t k = 0;
+            for (; k < base.size(); ++k) {
+                pos = scan_for(names, pos, lower[k], upper[k]);
+                if (names[pos] == '\0')
+                    break;
+                pos++;
+            }
+            if (k == base.size() &&
+                (!dirs_only || is_directory_entry(*listing, i)))
+                hits.push_back(i);
+        }
+    }
+    if (hits.empty())
+        return nullptr;
+    // The text readline substitutes: the longest common prefix for prefix
+    // hits, or the word as typed when fuzzy hits need not share a prefix.
+    std::string common = names + listing->offsets[hits[0]];
+    if (fuzzy && hits.size() > 1) {
+        common = base;
+    } else {
+        for (size_t i : hits) {
+            const char *name = names + listing->offsets[i];
+            size_t n = 0;
+            while (n < common.size() && name[n] == common[n])
+                n++;
+            common.resize(n);
+        }
+        // Hits differing only in case can share less than the typed text;
+        // never substitute something shorter than what was typed.
+        if (common.size() < base.size())
+            common = base;
+    }
+    std::vector<std::pair<int, size_t>> ranked;
+    ranked.reserve(hits.size());
+    for (size_t i : hits) {
+        const char *name = names + listing->offsets[i];
+        ranked.emplace_back(fuzzy_score(name, strlen(name), base), i);
+    }
+    size_t keep = std::min(ranked.size(), kMaxCompletions);
+    std::partial_sort(ranked.begin(), ranked.begin() + keep, ranked.end(),
+                      [&](const auto &a, const auto &b) {
+                          if (a.first != b.first)
+                              return a.first > b.first;
+                          return strcmp(names + listing->offsets[a.second],
+                                        names + listing->offsets[b.second]) < 0;
+                      });
+    size_t count = (hits.size() == 1) ? 0 : keep;
+    path_omitted_matches = hits.size() - keep;
+    char **matches =
+        static_cast<char **>(malloc((count + 2) * sizeof(char *)));
+    matches[0] = strdup((dir_part + common).c_str());
+    for (size_t r = 0; r < count; ++r) {
+        std::string name = names + listing->offsets[ranked[r].second];
+        matches[r + 1] = strdup((dir_part + name).c_str());
+    }
+    matches[count + 1] = nullptr;
+    return matches;
+}
 char **custom_completion(const char *text, int start, int end) {
     rl_attempted_completion_over = 1;
     std::string current_prefix(text);
@@ -81,7 +405,19 @@ char **custom_completion(const char *text, int start, int end) {
         tab_press_count = 0;
         last_multiple_matches = false;
     }
-    char **matches = rl_completion_matches(text, command_generator);
+    CompletionContext context = completion_context(start);
+    bool path_context = context != CompletionContext::Command;
+    char **matches;
+    if (path_context) {
+        // Results arrive ranked; keep readline from re-sorting them.
+        rl_filename_completion_desired = 1;
+        rl_sort_completion_matches = 0;
+        matches =
+            path_completion(text, context == CompletionContext::Directory);
+    } else {
+        rl_sort_completion_matches = 1;
+        matches = rl_completion_matches(text, command_generator);
+    }
     int match_count = 0;
     if (matches) {
         while (matches[match_count] != nullptr)
@@ -98,13 +434,21 @@ char **custom_completion(const char *text, int start, int end) {
             std::cout << std::endl;
             // Skip the prefix itself if it's included as a match
             int start_index = 0;
-            if (match_count > 0 && strcmp(matches[0], text) == 0) {
+            if (match_count > 0 &&
+                (path_context || strcmp(matches[0], text) == 0)) {
                 start_index = 1;
             }
             for (int i = start_index; i < match_count; i++) {
-                std::cout << matches[i] << "  ";
+                const char *shown = matches[i];
+                if (path_context && strrchr(shown, '/'))
+                    shown = strrchr(shown, '/') + 1;
+                std::cout << shown << "  ";
             }
             std::cout << std::endl;
+            if (path_context && path_omitted_matches > 0) {
+                std::cout << "... and " << path_omitted_matches << " more"
+                          << std::endl;
+            }
             rl_on_new_line();
             rl_replace_line(rl_line_buffer, 0);
             rl_redisplay();
@@ -221,6 +565,371 @@ bool run_cd(const std::string &path) {
     }
     return chdir(abs_path.c_str()) == 0;
 }
+// Execution tracing. Spans are pushed into a single-producer ring buffer by
+// the shell's main thread and drained by a flusher thread that writes
+// Chrome trace-event JSON (load it in Perfetto or chrome://tracing). Forked
+// children cannot reach the ring, so they send their spans back through a
+// close-on-exec pipe; its EOF tells the parent when execv completed. With
+// tracing off every span costs one branch on trace_enabled.
+enum TracePhase {
+    PhaseCommand,
+    PhaseParse,
+    PhaseResolve,
+    PhasePipe,
+    PhaseFork,
+    PhaseExec,
+    PhaseWait,
+    PhaseCount
+};
+static const char *const trace_phase_names[PhaseCount] = {
+    "command", "parse", "resolve", "pipe", "fork", "exec", "wait"};
+struct TraceEvent {
+    uint64_t start_ns;
+    uint64_t dur_ns;
+    int32_t tid;
+    uint8_t phase;
+    char label[43];
+};
+struct TraceHistogram {
+    uint64_t count = 0;
+    uint64_t total_ns = 0;
+    uint64_t max_ns = 0;
+    uint64_t buckets[64] = {};
+};
+static const size_t kTraceRingSize = 4096;
+static TraceEvent trace_ring[kTraceRingSize];
+static std::atomic<uint64_t> trace_head{0};
+static std::atomic<uint64_t> trace_tail{0};
+static std::atomic<bool> trace_stopping{false};
+// Heap-held so forked children, which exit() with a copy of it, never run
+// the destructor of a joinable thread.
+static std::thread *trace_flusher = nullptr;
+static TraceHistogram trace_histograms[PhaseCount];
+static uint64_t trace_dropped = 0;
+static bool trace_enabled = false;
+static int trace_fd = -1;
+static int trace_report_fd = -1;
+static pid_t trace_owner = 0;
+static uint64_t trace_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return uint64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+// Span start time, or 0 (which trace_emit ignores) when tracing is off.
+static uint64_t trace_clock() { return trace_enabled ? trace_now() : 0; }
+// Main thread only: records the span in the session histogram and, when a
+// trace file is open, publishes it to the flusher.
+static void trace_commit(const TraceEvent &ev) {
+    TraceHistogram &h = trace_histograms[ev.phase];
+    h.count++;
+    h.total_ns += ev.dur_ns;
+    h.max_ns = std::max(h.max_ns, ev.dur_ns);
+    // Relayed child events are not trusted to stay inside the 64 buckets.
+    h.buckets[ev.dur_ns ? std::min(63, 64 - __builtin_clzll(ev.dur_ns)) : 0]++;
+    if (trace_fd < 0)
+        return;
+    uint64_t head = trace_head.load(std::memory_order_relaxed);
+    if (head - trace_tail.load(std::memory_order_acquire) == kTraceRingSize) {
+        trace_dropped++;
+        return;
+    }
+    trace_ring[head % kTraceRingSize] = ev;
+    trace_head.store(head + 1, std::memory_order_release);
+}
+// Copies as much of src as fits without splitting a UTF-8 sequence, which
+// would leave invalid UTF-8 in the JSON.
+static void copy_label(char (&dst)[sizeof(TraceEvent::label)],
+                       const char *src) {
+    size_t n = strnlen(src, sizeof(dst));
+    if (n == sizeof(dst)) {
+        n--;
+        while (n > 0 && (static_cast<unsigned char>(src[n]) & 0xC0) == 0x80)
+            n--;
+    }
+    memcpy(dst, src, n);
+    dst[n] = '\0';
+}
+static void trace_emit(TracePhase phase, uint64_t start, uint64_t end,
+                       const char *label) {
+    if (!trace_enabled || start == 0)
+        return;
+    TraceEvent ev{};
+    ev.start_ns = start;
+    ev.dur_ns = end - start;
+    ev.tid = getpid();
+    ev.phase = phase;
+    copy_label(ev.label, label);
+    if (trace_report_fd >= 0) {
+        // In a forked child: a TraceEvent is well under PIPE_BUF, so the
+        // write is atomic.
+        ssize_t n = write(trace_report_fd, &ev, sizeof(ev));
+        (void)n;
+        return;
+    }
+    trace_commit(ev);
+}
+struct TraceSpan {
+    TracePhase phase;
+    const char *label;
+    uint64_t start;
+    TraceSpan(TracePhase phase, const std::string &label)
+        : phase(phase), label(label.c_str()),
+          start(trace_clock()) {}
+    ~TraceSpan() {
+        if (start)
+            trace_emit(phase, start, trace_now(), label);
+    }
+};
+// Pipe a child uses to report its spans; {-1, -1} when tracing is off.
+static void trace_open_report(int fds[2]) {
+    fds[0] = fds[1] = -1;
+    if (trace_enabled && pipe2(fds, O_CLOEXEC | O_NONBLOCK) < 0)
+        fds[0] = fds[1] = -1;
+}
+static void trace_enter_child(int report[2]) {
+    if (report[0] >= 0)
+        close(report[0]);
+    trace_report_fd = report[1];
+}
+// Relays child spans from report pipes. A child's exec event only marks
+// when it called execv; the span is closed at the EOF that execv's
+// close-on-exec produces, so it times the exec itself. EOF is only seen
+// when the parent polls, so pipelines pump with a zero timeout after every
+// fork rather than only once all stages are running.
+struct TraceReports {
+    std::vector<pollfd> pending;
+    std::vector<TraceEvent> exec_marks;
+    void add(int fd) {
+        if (fd < 0)
+            return;
+        pending.push_back({fd, POLLIN, 0});
+        exec_marks.push_back(TraceEvent{});
+    }
+    // Returns false once the pipe at i has reached EOF and been closed.
+    bool drain(size_t i) {
+        TraceEvent ev;
+        ssize_t n;
+        while ((n = read(pending[i].fd, &ev, sizeof(ev))) == sizeof(ev)) {
+            if (ev.phase == PhaseExec)
+                exec_marks[i] = ev;
+            else if (ev.phase < PhaseCount)
+                trace_commit(ev);
+        }
+        if (n < 0 && errno == EAGAIN)
+            return true;
+        uint64_t eof = trace_now();
+        TraceEvent &mark = exec_marks[i];
+        if (mark.start_ns && trace_enabled) {
+            mark.dur_ns = eof > mark.start_ns ? eof - mark.start_ns : 0;
+            trace_commit(mark);
+        }
+        close(pending[i].fd);
+        return false;
+    }
+    void pump(int timeout_ms) {
+        if (pending.empty())
+            return;
+        int ready = poll(pending.data(), pending.size(), timeout_ms);
+        if (ready < 0 && errno != EINTR) {
+            finish();
+            return;
+        }
+        for (size_t i = 0; ready > 0 && i < pending.size();) {
+            if (pending[i].revents && !drain(i)) {
+                pending.erase(pending.begin() + i);
+                exec_marks.erase(exec_marks.begin() + i);
+            } else {
+                ++i;
+            }
+        }
+    }
+    // Blocks until every child has exec'd or exited.
+    void wait_all() {
+        while (!pending.empty())
+            pump(-1);
+    }
+    void finish() {
+        for (pollfd &p : pending)
+            close(p.fd);
+        pending.clear();
+        exec_marks.clear();
+    }
+};
+static void json_escape(std::string &out, const char *s) {
+    for (; *s; ++s) {
+        unsigned char c = *s;
+        if (c == '"' || c == '\\') {
+            out += '\\';
+            out += c;
+        } else if (c < 0x20) {
+            char esc[8];
+            snprintf(esc, sizeof(esc), "\\u%04x", c);
+            out += esc;
+        } else {
+            out += c;
+        }
+    }
+}
+static void trace_drain(std::string &buf) {
+    uint64_t tail = trace_tail.load(std::memory_order_relaxed);
+    uint64_t head = trace_head.load(std::memory_order_acquire);
+    for (; tail != head; ++tail) {
+        const TraceEvent &ev = trace_ring[tail % kTraceRingSize];
+        char line[160];
+        snprintf(line, sizeof(line),
+                 ",\n{\"name\":\"%s\",\"cat\":\"shell\",\"ph\":\"X\","
+                 "\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%d,"
+                 "\"args\":{\"label\":\"",
+                 trace_phase_names[ev.phase], ev.start_ns / 1000.0,
+                 ev.dur_ns / 1000.0, int(trace_owner), int(ev.tid));
+        buf += line;
+        json_escape(buf, ev.label);
+        buf += "\"}}";
+    }
+    trace_tail.store(tail, std::memory_order_release);
+}
+static void trace_write(const std::string &buf) {
+    size_t off = 0;
+    while (off < buf.size()) {
+        ssize_t n = write(trace_fd, buf.data() + off, buf.size() - off);
+        if (n <= 0)
+            break;
+        off += n;
+    }
+}
+static void trace_flush_loop() {
+    std::string buf;
+    for (;;) {
+        bool last = trace_stopping.load(std::memory_order_acquire);
+        trace_drain(buf);
+        if (!buf.empty()) {
+            trace_write(buf);
+            buf.clear();
+        }
+        if (last)
+            return;
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    }
+}
+void trace_stop() {
+    if (getpid() != trace_owner)
+        return;
+    trace_enabled = false;
+    if (trace_fd < 0)
+        return;
+    trace_stopping.store(true, std::memory_order_release);
+    trace_flusher->join();
+    delete trace_flusher;
+    trace_flusher = nullptr;
+    trace_write("\n]\n");
+    close(trace_fd);
+    trace_fd = -1;
+    if (trace_dropped) {
+        std::cerr << "trace: dropped " << trace_dropped << " spans"
+                  << std::endl;
+        trace_dropped = 0;
+    }
+}
+// An empty file name keeps the session histograms without writing a trace.
+bool trace_start(const std::string &file) {
+    trace_stop();
+    trace_owner = getpid();
+    if (!file.empty()) {
+        trace_fd = open(file.c_str(), O_CREAT | O_WRONLY | O_TRUNC | O_CLOEXEC,
+                        0644);
+        if (trace_fd < 0) {
+            perror(("trace: " + file).c_str());
+            return false;
+        }
+        std::string header = "[\n{\"name\":\"process_name\",\"ph\":\"M\","
+                             "\"pid\":" +
+                             std::to_string(trace_owner) +
+                             ",\"args\":{\"name\":\"shell\"}}";
+        trace_write(header);
+        trace_stopping.store(false, std::memory_order_relaxed);
+        trace_flusher = new std::thread(trace_flush_loop);
+    }
+    trace_enabled = true;
+    return true;
+}
+static std::string format_ns(uint64_t ns) {
+    char out[32];
+    if (ns < 1000)
+        snprintf(out, sizeof(out), "%lluns", (unsigned long long)ns);
+    else if (ns < 1000000)
+        snprintf(out, sizeof(out), "%.1fus", ns / 1e3);
+    else if (ns < 1000000000)
+        snprintf(out, sizeof(out), "%.1fms", ns / 1e6);
+    else
+        snprintf(out, sizeof(out), "%.2fs", ns / 1e9);
+    return out;
+}
+// Bucket b holds durations in [2^(b-1), 2^b) ns; percentiles report the
+// bucket's upper bound, capped at the observed maximum.
+static uint64_t histogram_percentile(const TraceHistogram &h, double p) {
+    // Nearest rank: the smallest sample with at least p of the data at or
+    // below it.
+    uint64_t rank = std::max<uint64_t>(1, uint64_t(std::ceil(p * h.count)));
+    uint64_t seen = 0;
+    for (int b = 0; b < 64; ++b) {
+        seen += h.buckets[b];
+        if (seen >= rank)
+            return std::min(h.max_ns, b ? uint64_t(1) << b : 0);
+    }
+    return h.max_ns;
+}
+void print_trace_summary() {
+    bool any = false;
+    for (int p = 0; p < PhaseCount; ++p) {
+        const TraceHistogram &h = trace_histograms[p];
+        if (h.count == 0)
+            continue;
+        if (!any) {
+            printf("%-8s %7s %9s %9s %9s %9s\n", "phase", "count", "mean",
+                   "p50", "p99", "max");
+            any = true;
+        }
+        printf("%-8s %7llu %9s %9s %9s %9s\n", trace_phase_names[p],
+               (unsigned long long)h.count,
+               format_ns(h.total_ns / h.count).c_str(),
+               format_ns(histogram_percentile(h, 0.5)).c_str(),
+               format_ns(histogram_percentile(h, 0.99)).c_str(),
+               format_ns(h.max_ns).c_str());
+        uint64_t peak = *std::max_element(h.buckets, h.buckets + 64);
+        for (int b = 0; b < 64; ++b) {
+            if (h.buckets[b] == 0)
+                continue;
+            std::string range = "<" + format_ns(b ? uint64_t(1) << b : 1);
+            int width = int((h.buckets[b] * 40 + peak - 1) / peak);
+            printf("  %10s |%-40s %llu\n", range.c_str(),
+                   std::string(width, '#').c_str(),
+                   (unsigned long long)h.buckets[b]);
+        }
+    }
+    if (!any)
+        std::cout << "tracestat: no spans recorded (enable with set -o trace)"
+                  << std::endl;
+    std::cout << std::flush;
+}
+bool run_set(const std::vector<std::string> &args) {
+    if (args.size() == 1 || (args.size() == 2 && args[1] == "-o")) {
+        std::cout << "trace\t" << (trace_enabled ? "on" : "off") << std::endl;
+        return true;
+    }
+    if (args.size() == 3 && args[2].compare(0, 5, "trace") == 0 &&
+        (args[2].size() == 5 || args[2][5] == '=')) {
+        if (args[1] == "-o") {
+            trace_start(args[2].size() > 5 ? args[2].substr(6) : "");
+            return true;
+        }
+        if (args[1] == "+o") {
+            trace_stop();
+            return true;
+        }
+    }
+    std::cerr << "set: usage: set [-o|+o] trace[=FILE]" << std::endl;
+    return true;
+}
 bool handle_builtin(const std::string &input) {
     std::vector<std::string> args = split(input);
     if (args.empty())
@@ -307,7 +1016,8 @@ bool handle_builtin(const std::string &input) {
     if (args[0] == "type" && args.size() == 2) {
         const std::string &arg = args[1];
         if (arg == "echo" || arg == "exit" || arg == "type" || arg == "pwd" ||
-            arg == "cd" || arg == "history") {
+            arg == "cd" || arg == "history" || arg == "set" ||
+            arg == "tracestat") {
             std::cout << arg << " is a shell builtin" << std::endl;
         } else {
             std::string path = find_executable(arg);
@@ -337,6 +1047,13 @@ bool handle_builtin(const std::string &input) {
         }
         return true;
     }
+    if (args[0] == "set") {
+        return run_set(args);
+    }
+    if (args[0] == "tracestat") {
+        print_trace_summary();
+        return true;
+    }
     if (args[0] == "history") {
         HIST_ENTRY **the_list = history_list();
         if (!the_list) return true;
@@ -364,8 +1081,12 @@ bool handle_builtin(const std::string &input) {
 }
 void execute_command(const std::vector<std::string> &args,
                      const std::string &path) {
+    int report[2];
+    trace_open_report(report);
+    uint64_t fork_start = trace_clock();
     pid_t pid = fork();
     if (pid == 0) {
+        trace_enter_child(report);
         int stdout_fd = -1, stderr_fd = -1;
         std::vector<char *> exec_args;
         for (size_t i = 0; i < args.size(); ++i) {
@@ -399,21 +1120,41 @@ void execute_command(const std::vector<std::string> &args,
             close(stderr_fd);
         }
         exec_args.push_back(nullptr);
+        uint64_t exec_start = trace_clock();
+        trace_emit(PhaseExec, exec_start, exec_start, args[0].c_str());
         execv(path.c_str(), exec_args.data());
         perror("execv");
         std::exit(1);
     } else if (pid > 0) {
+        trace_emit(PhaseFork, fork_start, trace_now(), args[0].c_str());
+        if (report[1] >= 0)
+            close(report[1]);
+        TraceReports reports;
+        reports.add(report[0]);
+        reports.wait_all();
         int status;
+        TraceSpan span(PhaseWait, args[0]);
         waitpid(pid, &status, 0);
     } else {
         perror("fork");
+        if (report[0] >= 0) {
+            close(report[0]);
+            close(report[1]);
+        }
     }
 }
 std::vector<std::string> split_pipeline(const std::string &input) {
     std::vector<std::string> parts;
     std::string token;
     bool in_single_quote = false, in_double_quote = false;
-    for (char c : input) {
+    for (size_t i = 0; i < input.size(); ++i) {
+        char c = input[i];
+        // Keep escapes for split(); an escaped quote or '|' is literal.
+        if (c == '\\' && !in_single_quote && i + 1 < input.size()) {
+            token += c;
+            token += input[++i];
+            continue;
+        }
         if (c == '\'' && !in_double_quote) {
             in_single_quote = !in_single_quote;
         } else if (c == '"' && !in_single_quote) {
@@ -433,6 +1174,15 @@ int main() {
     std::cout << std::unitbuf;
     std::cerr << std::unitbuf;
     rl_attempted_completion_function = custom_completion;
+    // readline's default word breaks minus the backslash, which now escapes.
+    rl_completer_word_break_characters = " \t\n\"'`@$><=;|&{(";
+    rl_completer_quote_characters = "'\"";
+    rl_filename_quote_characters = kFilenameQuoteChars;
+    rl_filename_quoting_function = quote_filename;
+    rl_char_is_quoted_p = char_is_quoted;
+    if (const char *trace_file = std::getenv("SHELL_TRACE"))
+        trace_start(trace_file);
+    std::atexit(trace_stop);
     char *buf;
     std::string cmd;
     while ((buf = readline("$ ")) != nullptr) {
@@ -441,23 +1191,36 @@ int main() {
         if (cmd.empty())
             continue;
         add_history(cmd.c_str());
-        std::vector<std::string> pipeline_parts = split_pipeline(cmd);
+        TraceSpan command_span(PhaseCommand, cmd);
+        std::vector<std::string> pipeline_parts;
+        {
+            TraceSpan span(PhaseParse, cmd);
+            pipeline_parts = split_pipeline(cmd);
+        }
         if (pipeline_parts.size() >= 2) {
             size_t n = pipeline_parts.size();
             std::vector<int> pipes(2 * (n - 1)); // each pipe has 2 fds
-            for (size_t i = 0; i < n - 1; ++i) {
-                if (pipe(&pipes[2 * i]) < 0) {
-                    perror("pipe");
-                    exit(EXIT_FAILURE);
+            {
+                TraceSpan span(PhasePipe, cmd);
+                for (size_t i = 0; i < n - 1; ++i) {
+                    if (pipe(&pipes[2 * i]) < 0) {
+                        perror("pipe");
+                        exit(EXIT_FAILURE);
+                    }
                 }
             }
             std::vector<pid_t> pids;
+            TraceReports reports;
             for (size_t i = 0; i < n; ++i) {
+                int report[2];
+                trace_open_report(report);
+                uint64_t fork_start = trace_clock();
                 pid_t pid = fork();
                 if (pid < 0) {
                     perror("fork");
                     exit(EXIT_FAILURE);
                 } else if (pid == 0) {
+                    trace_enter_child(report);
                     // Setup input pipe
                     if (i > 0) {
                         dup2(pipes[2 * (i - 1)], STDIN_FILENO);
@@ -472,10 +1235,18 @@ int main() {
                     }
                     std::string part = pipeline_parts[i];
                     if (!handle_builtin(part)) {
-                        std::vector<std::string> args = split(part);
+                        std::vector<std::string> args;
+                        {
+                            TraceSpan span(PhaseParse, part);
+                            args = split(part);
+                        }
                         if (args.empty())
                             exit(1);
-                        std::string path = find_executable(args[0]);
+                        std::string path;
+                        {
+                            TraceSpan span(PhaseResolve, args[0]);
+                            path = find_executable(args[0]);
+                        }
                         if (path.empty()) {
                             std::cerr << args[0] << ": command not found"
                                       << std::endl;
@@ -486,29 +1257,48 @@ int main() {
                             c_args.push_back(const_cast<char *>(arg.c_str()));
                         }
                         c_args.push_back(nullptr);
+                        uint64_t exec_start = trace_clock();
+                        trace_emit(PhaseExec, exec_start, exec_start,
+                                   args[0].c_str());
                         execv(path.c_str(), c_args.data());
                         perror("execv");
                         exit(1);
                     }
                     exit(0);
                 }
+                trace_emit(PhaseFork, fork_start, trace_now(),
+                           pipeline_parts[i].c_str());
+                if (report[1] >= 0)
+                    close(report[1]);
+                reports.add(report[0]);
+                reports.pump(0);
                 pids.push_back(pid);
             }
             for (size_t i = 0; i < 2 * (n - 1); ++i) {
                 close(pipes[i]);
             }
-            for (pid_t pid : pids) {
-                waitpid(pid, nullptr, 0);
+            reports.wait_all();
+            for (size_t i = 0; i < pids.size(); ++i) {
+                TraceSpan span(PhaseWait, pipeline_parts[i]);
+                waitpid(pids[i], nullptr, 0);
             }
             continue;
         }
         if (handle_builtin(cmd)) {
             continue;
         }
-        std::vector<std::string> args = split(cmd);
+        std::vector<std::string> args;
+        {
+            TraceSpan span(PhaseParse, cmd);
+            args = split(cmd);
+        }
         if (args.empty())
             continue;
-        std::string path = find_executable(args[0]);
+        std::string path;
+        {
+            TraceSpan span(PhaseResolve, args[0]);
+            path = find_executable(args[0]);
+        }
         if (path.empty()) {
             std::cerr << args[0] << ": command not found" << std::endl;
             continue;